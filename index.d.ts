@@ -33,8 +33,30 @@ interface UndistortExtra {
    * For WEBP, it can be a quality ( CV_IMWRITE_WEBP_QUALITY ) from 1 to 100 (the higher is the better). By default (without any parameter) and for quality above 100 the lossless compression is used.
    */
   quantity?: number;
+  // JPEG only: compute optimal Huffman tables, slower to encode. Default value is false.
+  jpegOptimize?: boolean;
+  // JPEG only: write a progressive JPEG, slower to encode. Default value is false.
+  jpegProgressive?: boolean;
+  // JPEG only: chroma subsampling, `4:2:0` is the fastest and the libjpeg default (requires OpenCV 4.5.5).
+  jpegSampling?: "4:1:1" | "4:2:0" | "4:2:2" | "4:4:0" | "4:4:4";
+  // JPEG only: restart interval in MCUs from 0 to 65535, 0 disables restart markers. Default value is 0.
+  jpegRestartInterval?: number;
+  // PNG only: zlib strategy, `rle` and `huffman` trade size for speed. Default value is `default`.
+  pngStrategy?: "default" | "filtered" | "huffman" | "rle" | "fixed";
+  // PNG only: row filter, `none` and `sub` are the cheapest (requires OpenCV 4.11).
+  pngFilter?: "none" | "sub" | "up" | "avg" | "paeth" | "fast" | "all";
   // Scale of the dest image
   scale?: number;
+  // Upper bound on the threads used for this call, capped by the budget given to `setThreads`
+  threads?: number;
+  /**
+   * How the remap is scheduled
+   * `tile` splits the frame into row stripes across the thread budget, best latency for a lone large frame.
+   * `frame` keeps the frame on the calling thread, best throughput when many frames are undistorted concurrently.
+   * `auto` tiles a frame while it is the only one in flight and runs it on the calling thread otherwise. Default value is `auto`.
+   * Only one frame at a time is tiled across the pool: while it runs, concurrent `tile` frames run on their calling thread too.
+   */
+  mode?: "auto" | "tile" | "frame";
 }
 
 /**
@@ -50,3 +72,10 @@ export function undistort(
   D: Vet4d,
   extra?: UndistortExtra
 ): Buffer;
+
+/**
+ * Sets the process-wide thread budget shared by all undistort calls.
+ * @param threads - Number of threads, 0 or less means one per CPU.
+ * @returns The budget in effect.
+ */
+export function setThreads(threads?: number): number;
@@ -0,0 +1,48 @@
+#ifndef FISHEYE_CALIBRATE_H
+#define FISHEYE_CALIBRATE_H
+
+#include <opencv2/core.hpp>
+#include <opencv2/calib3d.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <vector>
+
+// Calibration pipeline shared by the addon, the CLI and the golden tests.
+
+inline std::vector<cv::Point3f> calibratePattern(cv::Size checkboardSize, float squareSize)
+{
+    std::vector<cv::Point3f> ret;
+    for (int i = 0; i < checkboardSize.height; i++)
+    {
+        for (int j = 0; j < checkboardSize.width; j++)
+        {
+            ret.push_back(cv::Point3f(float(j * squareSize), float(i * squareSize), 0));
+        }
+    }
+    return ret;
+}
+
+// Detects the inner corners of the checkboard in a grayscale image and refines them to sub-pixel accuracy.
+inline bool findCheckboardCorners(const cv::Mat &img, cv::Size checkboardSize, cv::Mat &corners)
+{
+    bool found = cv::findChessboardCorners(img, checkboardSize, corners,
+        cv::CALIB_CB_ADAPTIVE_THRESH | cv::CALIB_CB_NORMALIZE_IMAGE);
+    if (found)
+    {
+        cv::TermCriteria subpixCriteria(cv::TermCriteria::EPS | cv::TermCriteria::MAX_ITER, 30, 0.1);
+        cv::cornerSubPix(img, corners, cv::Size(3, 3), cv::Size(-1, -1), subpixCriteria);
+    }
+    return found;
+}
+
+// Solves K and D from the corners of every detected checkboard, returns the reprojection error.
+inline double calibrateFisheye(const std::vector<cv::Mat> &imgPoints, cv::Size checkboardSize, cv::Size imageSize,
+                               cv::Matx33d &K, cv::Vec4d &D)
+{
+    std::vector<std::vector<cv::Point3f> > objPoints(imgPoints.size(), calibratePattern(checkboardSize, 1.0));
+    int flag = cv::fisheye::CALIB_RECOMPUTE_EXTRINSIC | cv::fisheye::CALIB_CHECK_COND | cv::fisheye::CALIB_FIX_SKEW;
+    cv::TermCriteria criteria(cv::TermCriteria::EPS | cv::TermCriteria::MAX_ITER, 30, 1e-6);
+    return cv::fisheye::calibrate(objPoints, imgPoints, imageSize, K, D, cv::noArray(), cv::noArray(), flag, criteria);
+}
+
+#endif
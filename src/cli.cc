@@ -11,9 +11,18 @@
 #include <string>
 #include <algorithm>
 #include <cctype>
+#include <atomic>
+#include <limits>
+#include <mutex>
+
+#include "calibrate.h"
+#include "policy.h"
 
 namespace fs = std::filesystem;
 
+// Largest per-pixel difference --check accepts against cv::fisheye::undistortImage
+const double CHECK_MAX_LSB = 0;
+
 // #define WINGUI
 
 #ifdef WINGUI
@@ -212,16 +221,6 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
 
 // --- EXISTING CALIBRATION LOGIC ---
 
-std::vector<cv::Point3f> calibratePattern(cv::Size checkboardSize, float squareSize) {
-	std::vector<cv::Point3f> ret;
-	for (int i = 0; i < checkboardSize.height; i++) {
-		for (int j = 0; j < checkboardSize.width; j++) {
-			ret.push_back(cv::Point3f(float(j * squareSize), float(i * squareSize), 0));
-		}
-	}
-	return ret;
-}
-
 std::string promptForInput(const std::string& message) {
 	std::cout << message;
 	std::string input;
@@ -235,6 +234,9 @@ bool usage() {
 	std::cout << "   Or: ./fisheye <src_dir> <dest_dir> <calibration_file> (Import Mode)" << std::endl;
 	std::cout << "   Or: ./fisheye -i (Interactive Mode)" << std::endl;
 	std::cout << "   Or: ./fisheye (Default Interactive Mode)" << std::endl;
+	std::cout << "Options: --threads <n> (thread budget, default: all cores)" << std::endl;
+	std::cout << "         --mode <auto|tile|frame> (tile: split each image across cores, frame: one image per core)" << std::endl;
+	std::cout << "         --check (compare every output against cv::fisheye::undistortImage, exit 1 on mismatch)" << std::endl;
 	// std::cout << "   Or: ./fisheye -gui (Window Mode)" << std::endl;
 
 	std::cout << "---" << std::endl;
@@ -250,9 +252,41 @@ int main(int argc, char** argv) {
 	bool exportCalibration = false;
 	bool importCalibration = false;
 
+	int threads = 0;
+	ExecMode mode = EXEC_AUTO;
+	bool check = false;
+
 	auto tik = std::chrono::high_resolution_clock::now();
 	auto tok = std::chrono::high_resolution_clock::now();
 
+	// Strip execution options, the remaining arguments stay positional
+	std::vector<char*> args;
+	for (int i = 0; i < argc; i++) {
+		std::string arg = argv[i];
+		if (arg == "--threads" && i + 1 < argc) {
+			try {
+				threads = std::stoi(argv[++i]);
+			} catch (const std::exception& e) {
+				std::cerr << "Error: Invalid thread count '" << argv[i] << "'." << std::endl;
+				return usage();
+			}
+		} else if (arg == "--mode" && i + 1 < argc) {
+			if (!parseExecMode(argv[++i], mode)) {
+				std::cerr << "Error: Unknown mode '" << argv[i] << "'." << std::endl;
+				return usage();
+			}
+		} else if (arg == "--check") {
+			check = true;
+		} else {
+			args.push_back(argv[i]);
+		}
+	}
+	argc = int(args.size());
+	args.push_back(nullptr);
+	argv = args.data();
+
+	setThreadBudget(threads);
+
 	// Check for GUI flag
 	if (argc > 1 && std::string(argv[1]) == "-gui") {
 		useGui = true;
@@ -367,21 +401,12 @@ int main(int argc, char** argv) {
 		// 2. Calibrate
 		std::cout << "Calibrating..." << std::endl;
 		cv::Size checkboardSize(checkboardWidth, checkboardHeight);
-		std::vector<std::vector<cv::Point3f>> objPoints;
 		std::vector<cv::Mat> imgPoints;
-		std::vector<cv::Point3f> pattern = calibratePattern(checkboardSize, 1.0);
-		cv::TermCriteria subpixCriteria(cv::TermCriteria::EPS | cv::TermCriteria::MAX_ITER, 30, 0.1);
 
 		for (auto& img : images) {
 			cv::Mat corners;
-			// Use CALIB_CB_ADAPTIVE_THRESH for better robustness
 			tik = std::chrono::high_resolution_clock::now();
-			bool found = cv::findChessboardCorners(img, checkboardSize, corners,
-				cv::CALIB_CB_ADAPTIVE_THRESH | cv::CALIB_CB_NORMALIZE_IMAGE);
-
-			if (found) {
-				objPoints.push_back(pattern);
-				cv::cornerSubPix(img, corners, cv::Size(3, 3), cv::Size(-1, -1), subpixCriteria);
+			if (findCheckboardCorners(img, checkboardSize, corners)) {
 				imgPoints.push_back(corners);
 			}
 
@@ -389,18 +414,16 @@ int main(int argc, char** argv) {
 			std::cout << "findChessboardCorners: " << std::chrono::duration_cast<std::chrono::milliseconds>(tok - tik).count() << std::endl;
 		}
 
-		if (objPoints.empty()) {
+		if (imgPoints.empty()) {
 			std::cerr << "Could not detect any checkboards with size " << checkboardWidth << "x" << checkboardHeight << std::endl;
 			if (useGui) std::system("pause");
 			return 1;
 		}
 
 		cv::Size size = images[0].size();
-		int flag = cv::fisheye::CALIB_RECOMPUTE_EXTRINSIC | cv::fisheye::CALIB_CHECK_COND | cv::fisheye::CALIB_FIX_SKEW;
-		cv::TermCriteria criteria(cv::TermCriteria::EPS | cv::TermCriteria::MAX_ITER, 30, 1e-6);
 
 		tik = std::chrono::high_resolution_clock::now();
-		double error = cv::fisheye::calibrate(objPoints, imgPoints, size, K, D, cv::noArray(), cv::noArray(), flag, criteria);
+		double error = calibrateFisheye(imgPoints, checkboardSize, size, K, D);
 		tok = std::chrono::high_resolution_clock::now();
 
 		std::cout << "Calibration done. Reprojection error: " << error << "Time: " << std::chrono::duration_cast<std::chrono::milliseconds>(tok - tik).count() << std::endl;
@@ -463,45 +486,108 @@ int main(int argc, char** argv) {
 		return 1;
 	}
 
-	int count = 0;
+	std::vector<fs::path> files;
 	for (const auto& entry : fs::directory_iterator(srcPath)) {
-		std::string p = entry.path().string();
 		if (!entry.is_regular_file()) continue;
 
-		std::string ext = entry.path().extension().string();
-		std::string filename = entry.path().stem().string();
-
-		std::string ext_lower = ext;
+		std::string ext_lower = entry.path().extension().string();
 		std::transform(ext_lower.begin(), ext_lower.end(), ext_lower.begin(),
 					   [](unsigned char c){ return std::tolower(c); });
 
 		if (ext_lower == ".jpg" || ext_lower == ".png" || ext_lower == ".jpeg" || ext_lower == ".bmp") {
-			cv::Mat distorted = cv::imread(p);
-			if (distorted.empty()) {
-				std::cerr << "Failed to read image: " << p << std::endl;
-				continue;
-			}
+			files.push_back(entry.path());
+		}
+	}
 
-			cv::Mat undistorted;
-			// K is used for both original and new camera matrix to keep the scale
-			tik = std::chrono::high_resolution_clock::now();
-			cv::fisheye::undistortImage(distorted, undistorted, K, D, K, distorted.size());
-			tok = std::chrono::high_resolution_clock::now();
+	std::atomic<int> count(0);
+	std::atomic<int> mismatches(0);
+	std::mutex logMutex;
+
+	// Striped remaps must match the single pass of cv::fisheye::undistortImage
+	auto checkFrame = [&](const std::string& p, const cv::Mat& distorted, const cv::Mat& undistorted) {
+		cv::Mat reference;
+		auto start = std::chrono::high_resolution_clock::now();
+		cv::fisheye::undistortImage(distorted, reference, K, D, K, distorted.size());
+		auto end = std::chrono::high_resolution_clock::now();
+
+		// Run both stripe layouts, whichever mode produced the saved output
+		cv::Mat serial, tiled;
+		undistortFrame(distorted, serial, K, D, distorted.size(), 1);
+		undistortFrame(distorted, tiled, K, D, distorted.size(), threadBudget().load());
+
+		double maxLsb = 0;
+		double psnr = std::numeric_limits<double>::infinity();
+		std::vector<const cv::Mat*> outputs = { &undistorted, &serial, &tiled };
+		for (const cv::Mat* out : outputs) {
+			maxLsb = std::max(maxLsb, cv::norm(*out, reference, cv::NORM_INF));
+			psnr = std::min(psnr, cv::PSNR(*out, reference));
+		}
 
-			std::cout << "Time: " << std::chrono::duration_cast<std::chrono::milliseconds>(tok - tik).count() << std::endl;
+		std::lock_guard<std::mutex> lock(logMutex);
+		std::cout << "Check: " << p << " max LSB " << maxLsb << ", PSNR " << psnr
+				  << ", reference time " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << std::endl;
+		if (maxLsb > CHECK_MAX_LSB) {
+			std::cerr << "Mismatch against cv::fisheye::undistortImage: " << p << std::endl;
+			mismatches++;
+		}
+	};
+
+	auto undistortFile = [&](const fs::path& inPath, ExecMode fileMode) {
+		std::string p = inPath.string();
+		cv::Mat distorted = cv::imread(p);
+		if (distorted.empty()) {
+			std::lock_guard<std::mutex> lock(logMutex);
+			std::cerr << "Failed to read image: " << p << std::endl;
+			return;
+		}
 
-			std::string outFilename = filename + "_undistored" + ext;
-			fs::path outPath = fs::path(destPath) / outFilename;
+		cv::Mat undistorted;
+		// K is used for both original and new camera matrix to keep the scale
+		auto start = std::chrono::high_resolution_clock::now();
+		{
+			FrameSlot slot;
+			undistortFrame(distorted, undistorted, K, D, distorted.size(), resolveThreads(fileMode, 0, distorted.size()));
+		}
+		auto end = std::chrono::high_resolution_clock::now();
 
-			if (cv::imwrite(outPath.string(), undistorted)) {
-				std::cout << "Saved to " << outPath.string() << std::endl;
-				count++;
-			} else {
-				std::cerr << "Failed to save to " << outPath.string() << std::endl;
+		if (check) {
+			checkFrame(p, distorted, undistorted);
+		}
+
+		std::string outFilename = inPath.stem().string() + "_undistored" + inPath.extension().string();
+		fs::path outPath = fs::path(destPath) / outFilename;
+		bool saved = cv::imwrite(outPath.string(), undistorted);
+
+		std::lock_guard<std::mutex> lock(logMutex);
+		std::cout << "Time: " << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << std::endl;
+		if (saved) {
+			std::cout << "Saved to " << outPath.string() << std::endl;
+			count++;
+		} else {
+			std::cerr << "Failed to save to " << outPath.string() << std::endl;
+		}
+	};
+
+	// A batch keeps every core busy with whole images, a lone image is tiled instead
+	bool perFrame = mode == EXEC_FRAME || (mode == EXEC_AUTO && files.size() > 1);
+	if (perFrame) {
+		cv::parallel_for_(cv::Range(0, int(files.size())), [&](const cv::Range& range) {
+			for (int i = range.start; i < range.end; i++) {
+				undistortFile(files[i], EXEC_FRAME);
 			}
+		});
+	} else {
+		for (const auto& file : files) {
+			undistortFile(file, EXEC_TILE);
 		}
 	}
-	std::cout << "Processed " << count << " images." << std::endl;
+	std::cout << "Processed " << count.load() << " images." << std::endl;
+
+	if (check && mismatches > 0) {
+		std::cerr << mismatches.load() << " images differ from cv::fisheye::undistortImage." << std::endl;
+		if (useGui) std::system("pause");
+		return 1;
+	}
 
 	if (useGui) std::system("pause");
 	return 0;
@@ -4,6 +4,13 @@
 #include <opencv2/imgproc.hpp>
 #include <opencv2/imgcodecs.hpp>
 
+#include <map>
+#include <memory>
+#include <string>
+
+#include "calibrate.h"
+#include "policy.h"
+
 cv::Mat toImageMat(Napi::Buffer<uchar> jsRawImg, int flag = cv::IMREAD_COLOR)
 {
     uchar *buf = jsRawImg.Data();
@@ -40,31 +47,198 @@ cv::Vec4d getD(Napi::Array jsArray)
     return mat;
 }
 
-Napi::Buffer<char> encodeMat(Napi::Env env, cv::Mat img, Napi::Object jsExtra) {
-    cv::String ext;
-    std::vector<int> params = std::vector<int>();
+// Encoded images are handed to JS without a copy. Each JS thread keeps the
+// vectors of collected Buffers and reuses their capacity for the next frame.
+const size_t ENCODE_POOL_SIZE = 8;
+
+std::vector<std::unique_ptr<std::vector<uchar>>> &encodePool()
+{
+    thread_local std::vector<std::unique_ptr<std::vector<uchar>>> pool;
+    return pool;
+}
+
+std::vector<uchar> *acquireEncodeBuffer()
+{
+    std::vector<std::unique_ptr<std::vector<uchar>>> &pool = encodePool();
+    if (pool.empty()) {
+        return new std::vector<uchar>();
+    }
+    std::vector<uchar> *buf = pool.back().release();
+    pool.pop_back();
+    return buf;
+}
+
+void releaseEncodeBuffer(Napi::Env env, char *data, std::vector<uchar> *buf)
+{
+    std::vector<std::unique_ptr<std::vector<uchar>>> &pool = encodePool();
+    if (pool.size() < ENCODE_POOL_SIZE) {
+        pool.emplace_back(buf);
+    } else {
+        delete buf;
+    }
+}
+
+bool lookupOption(const std::map<std::string, int> &table, Napi::Object jsExtra, const char *key, int &value)
+{
+    Napi::Value jsName = jsExtra.Get(key);
+    if (!jsName.IsString()) {
+        std::string message = std::string(key) + " must be a string";
+        Napi::TypeError::New(jsExtra.Env(), message).ThrowAsJavaScriptException();
+        return false;
+    }
+    std::string name = jsName.As<Napi::String>().Utf8Value();
+    auto it = table.find(name);
+    if (it == table.end()) {
+        std::string message = std::string("unknown ") + key + " '" + name + "'";
+        Napi::TypeError::New(jsExtra.Env(), message).ThrowAsJavaScriptException();
+        return false;
+    }
+    value = it->second;
+    return true;
+}
+
+bool numberOption(Napi::Object jsExtra, const char *key, int &value)
+{
+    Napi::Value jsValue = jsExtra.Get(key);
+    if (!jsValue.IsNumber()) {
+        std::string message = std::string(key) + " must be a number";
+        Napi::TypeError::New(jsExtra.Env(), message).ThrowAsJavaScriptException();
+        return false;
+    }
+    value = jsValue.As<Napi::Number>().Int32Value();
+    return true;
+}
+
+bool encodeParams(cv::String ext, Napi::Object jsExtra, std::vector<int> &params)
+{
+    if (ext == ".jpg" || ext == ".jpeg") {
+        if (jsExtra.Has("jpegOptimize")) {
+            params.push_back(cv::IMWRITE_JPEG_OPTIMIZE);
+            params.push_back(jsExtra.Get("jpegOptimize").ToBoolean().Value() ? 1 : 0);
+        }
+        if (jsExtra.Has("jpegProgressive")) {
+            params.push_back(cv::IMWRITE_JPEG_PROGRESSIVE);
+            params.push_back(jsExtra.Get("jpegProgressive").ToBoolean().Value() ? 1 : 0);
+        }
+        if (jsExtra.Has("jpegRestartInterval")) {
+            int interval;
+            if (!numberOption(jsExtra, "jpegRestartInterval", interval)) {
+                return false;
+            }
+            params.push_back(cv::IMWRITE_JPEG_RST_INTERVAL);
+            params.push_back(interval);
+        }
+        if (jsExtra.Has("jpegSampling")) {
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && (CV_VERSION_MINOR > 5 || (CV_VERSION_MINOR == 5 && CV_VERSION_REVISION >= 5)))
+            static const std::map<std::string, int> samplings = {
+                {"4:1:1", cv::IMWRITE_JPEG_SAMPLING_FACTOR_411},
+                {"4:2:0", cv::IMWRITE_JPEG_SAMPLING_FACTOR_420},
+                {"4:2:2", cv::IMWRITE_JPEG_SAMPLING_FACTOR_422},
+                {"4:4:0", cv::IMWRITE_JPEG_SAMPLING_FACTOR_440},
+                {"4:4:4", cv::IMWRITE_JPEG_SAMPLING_FACTOR_444},
+            };
+            int sampling;
+            if (!lookupOption(samplings, jsExtra, "jpegSampling", sampling)) {
+                return false;
+            }
+            params.push_back(cv::IMWRITE_JPEG_SAMPLING_FACTOR);
+            params.push_back(sampling);
+#else
+            Napi::Error::New(jsExtra.Env(), "jpegSampling requires OpenCV 4.5.5 or later").ThrowAsJavaScriptException();
+            return false;
+#endif
+        }
+    } else if (ext == ".png") {
+        if (jsExtra.Has("pngStrategy")) {
+            static const std::map<std::string, int> strategies = {
+                {"default", cv::IMWRITE_PNG_STRATEGY_DEFAULT},
+                {"filtered", cv::IMWRITE_PNG_STRATEGY_FILTERED},
+                {"huffman", cv::IMWRITE_PNG_STRATEGY_HUFFMAN_ONLY},
+                {"rle", cv::IMWRITE_PNG_STRATEGY_RLE},
+                {"fixed", cv::IMWRITE_PNG_STRATEGY_FIXED},
+            };
+            int strategy;
+            if (!lookupOption(strategies, jsExtra, "pngStrategy", strategy)) {
+                return false;
+            }
+            params.push_back(cv::IMWRITE_PNG_STRATEGY);
+            params.push_back(strategy);
+        }
+        if (jsExtra.Has("pngFilter")) {
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 11)
+            static const std::map<std::string, int> filters = {
+                {"none", cv::IMWRITE_PNG_FILTER_NONE},
+                {"sub", cv::IMWRITE_PNG_FILTER_SUB},
+                {"up", cv::IMWRITE_PNG_FILTER_UP},
+                {"avg", cv::IMWRITE_PNG_FILTER_AVG},
+                {"paeth", cv::IMWRITE_PNG_FILTER_PAETH},
+                {"fast", cv::IMWRITE_PNG_FAST_FILTERS},
+                {"all", cv::IMWRITE_PNG_ALL_FILTERS},
+            };
+            int filter;
+            if (!lookupOption(filters, jsExtra, "pngFilter", filter)) {
+                return false;
+            }
+            params.push_back(cv::IMWRITE_PNG_FILTER);
+            params.push_back(filter);
+#else
+            Napi::Error::New(jsExtra.Env(), "pngFilter requires OpenCV 4.11 or later").ThrowAsJavaScriptException();
+            return false;
+#endif
+        }
+    }
+    return true;
+}
+
+// Reads the output format and encoder options, validated before any pixel work.
+bool encodeOptions(Napi::Object jsExtra, cv::String &ext, std::vector<int> &params) {
     if (jsExtra.Has("extname")) {
-        ext = cv::String(jsExtra.Get("extname").As<Napi::String>().Utf8Value());
+        Napi::Value jsExtname = jsExtra.Get("extname");
+        if (!jsExtname.IsString()) {
+            Napi::TypeError::New(jsExtra.Env(), "extname must be a string").ThrowAsJavaScriptException();
+            return false;
+        }
+        ext = cv::String(jsExtname.As<Napi::String>().Utf8Value());
     } else {
         ext = cv::String(".jpg");
     }
     if (jsExtra.Has("quantity")) {
-        int quantity = int(jsExtra.Get("quantity").As<Napi::Number>().Int32Value());
+        int quantity;
+        if (!numberOption(jsExtra, "quantity", quantity)) {
+            return false;
+        }
         if (ext == ".jpg" || ext == ".jpeg") {
             params.push_back(cv::IMWRITE_JPEG_QUALITY);
             params.push_back(quantity);
         } else if (ext == ".png") {
             params.push_back(cv::IMWRITE_PNG_COMPRESSION);
             params.push_back(quantity);
-        } else if (ext == "webp") {
+        } else if (ext == ".webp") {
             params.push_back(cv::IMWRITE_WEBP_QUALITY);
             params.push_back(quantity);
         }
     }
-    std::vector<uchar> buf;
-    cv::imencode(ext, img, buf, params);
+    return encodeParams(ext, jsExtra, params);
+}
+
+Napi::Buffer<char> encodeMat(Napi::Env env, cv::Mat img, cv::String ext, const std::vector<int> &params) {
+    std::unique_ptr<std::vector<uchar>> buf(acquireEncodeBuffer());
+    buf->clear();
+    try {
+        cv::imencode(ext, img, *buf, params);
+    } catch (const cv::Exception &e) {
+        // An unknown extension or a missing codec, the vector goes back to the pool
+        releaseEncodeBuffer(env, nullptr, buf.release());
+        Napi::Error::New(env, e.what()).ThrowAsJavaScriptException();
+        return Napi::Buffer<char>();
+    }
 
-    Napi::Buffer<char> ret = Napi::Buffer<char>::Copy(env, reinterpret_cast<char*>(buf.data()), buf.size());
+    // Falls back to a copy, releasing the vector right away, where external buffers are not allowed
+    Napi::Buffer<char> ret = Napi::Buffer<char>::NewOrCopy(env, reinterpret_cast<char*>(buf->data()), buf->size(), releaseEncodeBuffer, buf.get());
+    if (!ret.IsEmpty()) {
+        // The finalizer owns the vector from here on
+        buf.release();
+    }
     return ret;
 }
 
@@ -97,9 +271,39 @@ Napi::Buffer<char> Undistort(const Napi::CallbackInfo &info)
     size.width *= scale;
     size.height *= scale;
 
-    cv::fisheye::undistortImage(distorted, undistorted, k, d, k, size);
+    int threads = 0;
+    if (jsExtra.Has("threads")) {
+        Napi::Value jsThreads = jsExtra.Get("threads");
+        if (!jsThreads.IsNumber()) {
+            Napi::TypeError::New(env, "threads must be a number").ThrowAsJavaScriptException();
+            return Napi::Buffer<char>();
+        }
+        threads = jsThreads.As<Napi::Number>().Int32Value();
+    }
+    if (env.IsExceptionPending()) {
+        return Napi::Buffer<char>();
+    }
+    ExecMode mode = EXEC_AUTO;
+    if (jsExtra.Has("mode")) {
+        Napi::Value jsMode = jsExtra.Get("mode");
+        if (!jsMode.IsString() || !parseExecMode(jsMode.As<Napi::String>().Utf8Value(), mode)) {
+            Napi::TypeError::New(env, "mode must be one of 'auto', 'tile' or 'frame'").ThrowAsJavaScriptException();
+            return Napi::Buffer<char>();
+        }
+    }
+
+    cv::String ext;
+    std::vector<int> params;
+    if (!encodeOptions(jsExtra, ext, params)) {
+        return Napi::Buffer<char>();
+    }
+
+    {
+        FrameSlot slot;
+        undistortFrame(distorted, undistorted, k, d, size, resolveThreads(mode, threads, size));
+    }
 
-    return encodeMat(env, undistorted, jsExtra);
+    return encodeMat(env, undistorted, ext, params);
 }
 
 std::vector<cv::Mat> getImages(Napi::Array jsImagesArray)
@@ -138,19 +342,6 @@ Napi::Array convertD(Napi::Env env, cv::Vec4d theD)
     return ret;
 }
 
-std::vector<cv::Point3f> calibratePattern(cv::Size checkboardSize, float squareSize)
-{
-    std::vector<cv::Point3f> ret;
-    for (int i = 0; i < checkboardSize.height; i++)
-    {
-        for (int j = 0; j < checkboardSize.width; j++)
-        {
-            ret.push_back(cv::Point3f(float(j*squareSize), float(i*squareSize), 0));
-        }
-    }
-    return ret;
-}
-
 Napi::Object Calibrate(const Napi::CallbackInfo &info)
 {
     Napi::Env env = info.Env();
@@ -162,33 +353,22 @@ Napi::Object Calibrate(const Napi::CallbackInfo &info)
     cv::Size checkboardSize(jsCheckboardWidth.Int32Value(), jsCheckboardHeight.Int32Value());
 
     std::vector<cv::Mat> images = getImages(jsImagesArray);
-    std::vector<std::vector<cv::Point3f> > objPoints;
     std::vector<cv::Mat> imgPoints;
 
     cv::Matx33d theK;
     cv::Vec4d theD;
 
-    cv::Size imgSize;
-
-    std::vector<cv::Point3f> pattern = calibratePattern(checkboardSize, 1.0);
-    cv::TermCriteria subpixCriteria(cv::TermCriteria::EPS | cv::TermCriteria::MAX_ITER, 30, 0.1);
     for (auto const &img : images)
     {
         cv::Mat corners;
-        bool found = cv::findChessboardCorners(img, checkboardSize, corners);
- 
-        if (found)
+        if (findCheckboardCorners(img, checkboardSize, corners))
         {
-            objPoints.push_back(pattern);
-            cv::cornerSubPix(img, corners, cv::Size(3, 3), cv::Size(-1, -1), subpixCriteria);
             imgPoints.push_back(corners);
         }
     }
 
     cv::Size size = images.at(0).size();
-    int flag = cv::fisheye::CALIB_RECOMPUTE_EXTRINSIC | cv::fisheye::CALIB_CHECK_COND | cv::fisheye::CALIB_FIX_SKEW;
-    cv::TermCriteria criteria(cv::TermCriteria::EPS | cv::TermCriteria::MAX_ITER, 30, 1e-6);
-    cv::fisheye::calibrate(objPoints, imgPoints, size, theK, theD, cv::noArray(), cv::noArray(), flag, criteria);
+    calibrateFisheye(imgPoints, checkboardSize, size, theK, theD);
 
     Napi::Array jsKArray = convertK(env, theK);
     Napi::Array jsDArray = convertD(env, theD);
@@ -200,10 +380,28 @@ Napi::Object Calibrate(const Napi::CallbackInfo &info)
     return ret;
 }
 
+Napi::Value SetThreads(const Napi::CallbackInfo &info)
+{
+    Napi::Env env = info.Env();
+
+    int threads = 0;
+    if (info.Length() > 0 && !info[0].IsUndefined()) {
+        if (!info[0].IsNumber()) {
+            Napi::TypeError::New(env, "threads must be a number").ThrowAsJavaScriptException();
+            return env.Undefined();
+        }
+        threads = info[0].As<Napi::Number>().Int32Value();
+    }
+    setThreadBudget(threads);
+
+    return Napi::Number::New(env, threadBudget().load());
+}
+
 Napi::Object Init(Napi::Env env, Napi::Object exports)
 {
     exports.Set("undistort", Napi::Function::New(env, Undistort));
     exports.Set("calibrate", Napi::Function::New(env, Calibrate));
+    exports.Set("setThreads", Napi::Function::New(env, SetThreads));
     return exports;
 }
 
@@ -0,0 +1,135 @@
+#ifndef FISHEYE_POLICY_H
+#define FISHEYE_POLICY_H
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/utility.hpp>
+#include <opencv2/calib3d.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+
+// Execution policy shared by the addon and the CLI.
+//
+// All parallel work goes through OpenCV's own parallel_for_ pool, sized once by
+// the global thread budget. OpenCV guards that pool with a process-wide flag:
+// while any thread is inside parallel_for_, every other parallel_for_, nested
+// or issued concurrently from another thread, runs inline on its caller. So
+// only one frame at a time is tiled across the pool, the frames running
+// alongside it stay on their own threads, and no second pool is ever stacked
+// on top of the first.
+
+enum ExecMode
+{
+    // Tile a frame while it is the only one in flight, run concurrent frames serially
+    EXEC_AUTO,
+    // Split one frame into row stripes across the thread budget (latency)
+    EXEC_TILE,
+    // Keep each frame on a single thread, one frame per core (throughput)
+    EXEC_FRAME
+};
+
+// Smallest stripe handed to a worker
+const int TILE_MIN_ROWS = 64;
+
+inline std::atomic<int> &threadBudget()
+{
+    static std::atomic<int> budget(cv::getNumThreads());
+    return budget;
+}
+
+inline std::atomic<int> &activeFrames()
+{
+    static std::atomic<int> active(0);
+    return active;
+}
+
+// Sets the process-wide thread budget, <= 0 restores one thread per CPU.
+inline void setThreadBudget(int threads)
+{
+    if (threads <= 0)
+    {
+        threads = cv::getNumberOfCPUs();
+    }
+    threadBudget() = threads;
+    cv::setNumThreads(threads);
+}
+
+inline bool parseExecMode(const std::string &name, ExecMode &mode)
+{
+    if (name == "auto")
+    {
+        mode = EXEC_AUTO;
+    }
+    else if (name == "tile")
+    {
+        mode = EXEC_TILE;
+    }
+    else if (name == "frame")
+    {
+        mode = EXEC_FRAME;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+// Marks a frame as in flight so auto mode can tell a lone frame from a concurrent one.
+struct FrameSlot
+{
+    FrameSlot() { activeFrames()++; }
+    ~FrameSlot() { activeFrames()--; }
+};
+
+// Number of stripes a frame of the given size may use, `requested` <= 0 means no per-call cap.
+inline int resolveThreads(ExecMode mode, int requested, cv::Size size)
+{
+    if (mode == EXEC_FRAME)
+    {
+        return 1;
+    }
+    if (mode == EXEC_AUTO && activeFrames() > 1)
+    {
+        return 1;
+    }
+
+    int threads = threadBudget();
+    if (requested > 0)
+    {
+        threads = std::min(threads, requested);
+    }
+    threads = std::min(threads, size.height / TILE_MIN_ROWS);
+    return std::max(1, threads);
+}
+
+// Equivalent to cv::fisheye::undistortImage(distorted, undistorted, K, D, K, size),
+// with the remap split into `threads` row stripes. An empty size keeps the input size.
+inline void undistortFrame(const cv::Mat &distorted, cv::Mat &undistorted,
+                           const cv::Matx33d &K, const cv::Vec4d &D, cv::Size size, int threads)
+{
+    if (size.empty())
+    {
+        size = distorted.size();
+    }
+    cv::Mat map1, map2;
+    cv::fisheye::initUndistortRectifyMap(K, D, cv::Matx33d::eye(), K, size, CV_16SC2, map1, map2);
+    undistorted.create(size, distorted.type());
+
+    // With a single stripe parallel_for_ calls the body inline and flags the
+    // region as nested, which also keeps cv::remap on the calling thread.
+    threads = std::max(1, std::min(threads, size.height));
+    cv::parallel_for_(cv::Range(0, threads), [&](const cv::Range &range) {
+        for (int i = range.start; i < range.end; i++)
+        {
+            cv::Range rows(size.height * i / threads, size.height * (i + 1) / threads);
+            cv::Mat stripe = undistorted.rowRange(rows);
+            cv::remap(distorted, stripe, map1.rowRange(rows), map2.rowRange(rows),
+                      cv::INTER_LINEAR, cv::BORDER_CONSTANT);
+        }
+    }, threads);
+}
+
+#endif
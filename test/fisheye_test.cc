@@ -0,0 +1,441 @@
+#include <opencv2/core.hpp>
+#include <opencv2/calib3d.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "calibrate.h"
+#include "policy.h"
+
+namespace fs = std::filesystem;
+
+// Golden outputs live in test/golden/<set>: calibration.txt holds K and D from
+// cv::fisheye::calibrate, <image>.png and <image>_half.png hold the output of
+// cv::fisheye::undistortImage at full and half size. `fisheye_test record`
+// rewrites them, only do so when an output change is intended.
+//
+// The example images are 200x110, too short to ever be split into stripes.
+// test/fixtures/large holds example/samples/IMG-0.jpg upscaled 8x, with the
+// samples calibration scaled to match, so the tiled paths get exercised too.
+
+// Lossless outputs may drift by one LSB between OpenCV builds
+const double GOLDEN_MAX_LSB = 1;
+const double GOLDEN_MIN_PSNR = 50;
+// JPEG at the default quality of 95 measures about 44dB against the golden PNG
+const double LOSSY_MIN_PSNR = 35;
+// K and D are not compared number by number: cv::fisheye::calibrate lands on
+// visibly different values across OpenCV builds (cy 68.08 vs 68.41, k3 0.068 vs
+// -0.0049 on the example sets) for equally good fits. A calibration is checked
+// by what it is used for instead: the example images undistorted with it must
+// stay close to the golden images, and the corners must reproject within a
+// fraction of a pixel. A calibration from another build measures about 40dB, a
+// 1% error on fx about 40dB too, a wrong one about 13dB.
+const double CALIBRATION_MIN_PSNR = 30;
+const double CALIBRATION_MAX_RMS = 0.5;
+// Budget used by the undistort tests, so tiling runs even on a single-core machine
+const int TEST_THREAD_BUDGET = 4;
+// A path fails when its throughput drops this far below the recorded baseline
+const double THROUGHPUT_TOLERANCE = 0.3;
+// Each path runs at least this long per round, best of three rounds
+const double THROUGHPUT_ROUND_SECONDS = 0.25;
+
+const cv::Size CHECKBOARD_SIZE(9, 6);
+
+int failures = 0;
+
+void expect(bool ok, const std::string& what)
+{
+    if (!ok)
+    {
+        std::cerr << "FAIL: " << what << std::endl;
+        failures++;
+    }
+}
+
+std::vector<fs::path> listImages(const std::string& dir)
+{
+    std::vector<fs::path> ret;
+    for (const auto& entry : fs::directory_iterator(dir))
+    {
+        std::string ext = entry.path().extension().string();
+        std::transform(ext.begin(), ext.end(), ext.begin(),
+                       [](unsigned char c){ return std::tolower(c); });
+        if (ext == ".jpg" || ext == ".png" || ext == ".jpeg" || ext == ".bmp")
+        {
+            ret.push_back(entry.path());
+        }
+    }
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+// Same layout as the CLI export: "fx fy cx cy" then "k1 k2 k3 k4"
+bool loadCalibration(const std::string& file, cv::Matx33d& K, cv::Vec4d& D)
+{
+    std::ifstream in(file);
+    double fx, fy, cx, cy;
+    if (!(in >> fx >> fy >> cx >> cy >> D[0] >> D[1] >> D[2] >> D[3]))
+    {
+        std::cerr << "Error: Could not read calibration from " << file << std::endl;
+        return false;
+    }
+    K = cv::Matx33d::eye();
+    K(0, 0) = fx; K(1, 1) = fy; K(0, 2) = cx; K(1, 2) = cy;
+    return true;
+}
+
+bool saveCalibration(const std::string& file, const cv::Matx33d& K, const cv::Vec4d& D)
+{
+    std::ofstream out(file);
+    out << std::setprecision(17);
+    out << K(0, 0) << " " << K(1, 1) << " " << K(0, 2) << " " << K(1, 2) << std::endl;
+    out << D[0] << " " << D[1] << " " << D[2] << " " << D[3] << std::endl;
+    return bool(out);
+}
+
+bool calibrateDir(const std::string& dir, cv::Matx33d& K, cv::Vec4d& D, double& rms)
+{
+    std::vector<cv::Mat> imgPoints;
+    cv::Size size;
+    for (const auto& p : listImages(dir))
+    {
+        cv::Mat img = cv::imread(p.string(), cv::IMREAD_GRAYSCALE);
+        cv::Mat corners;
+        if (size.empty())
+        {
+            size = img.size();
+        }
+        if (findCheckboardCorners(img, CHECKBOARD_SIZE, corners))
+        {
+            imgPoints.push_back(corners);
+        }
+    }
+    if (imgPoints.empty())
+    {
+        std::cerr << "Error: No checkboard found in " << dir << std::endl;
+        return false;
+    }
+    rms = calibrateFisheye(imgPoints, CHECKBOARD_SIZE, size, K, D);
+    return true;
+}
+
+void expectImage(const std::string& what, const cv::Mat& out, const cv::Mat& golden, double maxLsb, double minPsnr)
+{
+    if (out.size() != golden.size() || out.type() != golden.type())
+    {
+        expect(false, what + " size or type differs from golden");
+        return;
+    }
+    double lsb = cv::norm(out, golden, cv::NORM_INF);
+    double psnr = cv::PSNR(out, golden);
+    std::ostringstream msg;
+    msg << what << " max LSB " << lsb << ", PSNR " << psnr;
+    expect(lsb <= maxLsb && psnr >= minPsnr, msg.str());
+}
+
+cv::Mat readGolden(const std::string& goldenDir, const std::string& name)
+{
+    fs::path p = fs::path(goldenDir) / name;
+    cv::Mat img = cv::imread(p.string());
+    expect(!img.empty(), "missing golden " + p.string());
+    return img;
+}
+
+// Undistorts the example images with K and D and compares them with the golden images.
+void expectCalibration(const std::string& what, const std::string& exampleDir, const std::string& goldenDir,
+                       const cv::Matx33d& K, const cv::Vec4d& D)
+{
+    for (const auto& p : listImages(exampleDir))
+    {
+        cv::Mat distorted = cv::imread(p.string());
+        cv::Mat golden = readGolden(goldenDir, p.stem().string() + ".png");
+        cv::Mat out;
+        cv::fisheye::undistortImage(distorted, out, K, D, K, distorted.size());
+        expectImage(what + " on " + p.filename().string(), out, golden, 255, CALIBRATION_MIN_PSNR);
+    }
+}
+
+// Rewrites the golden outputs from cv::fisheye::calibrate and cv::fisheye::undistortImage,
+// or from the given calibration file for sets without a checkboard.
+int record(const std::string& exampleDir, const std::string& goldenDir, const std::string& calibrationFile)
+{
+    cv::Matx33d K;
+    cv::Vec4d D;
+    fs::create_directories(goldenDir);
+    double rms;
+    bool calibrated = calibrationFile.empty() ? calibrateDir(exampleDir, K, D, rms) : loadCalibration(calibrationFile, K, D);
+    if (!calibrated || !saveCalibration((fs::path(goldenDir) / "calibration.txt").string(), K, D))
+    {
+        return 1;
+    }
+    // Undistort with the values as read back, so the images match the file bit for bit
+    loadCalibration((fs::path(goldenDir) / "calibration.txt").string(), K, D);
+
+    for (const auto& p : listImages(exampleDir))
+    {
+        cv::Mat distorted = cv::imread(p.string());
+        cv::Mat full, half;
+        cv::Size size = distorted.size();
+        cv::fisheye::undistortImage(distorted, full, K, D, K, size);
+        cv::fisheye::undistortImage(distorted, half, K, D, K, cv::Size(size.width / 2, size.height / 2));
+        cv::imwrite((fs::path(goldenDir) / (p.stem().string() + ".png")).string(), full);
+        cv::imwrite((fs::path(goldenDir) / (p.stem().string() + "_half.png")).string(), half);
+    }
+    std::cout << "Recorded " << goldenDir << std::endl;
+    return 0;
+}
+
+int testCalibrate(const std::string& exampleDir, const std::string& goldenDir)
+{
+    cv::Matx33d K;
+    cv::Vec4d D;
+    double rms;
+    if (!calibrateDir(exampleDir, K, D, rms))
+    {
+        return 1;
+    }
+    std::ostringstream msg;
+    msg << exampleDir << " reprojection error " << rms << " px";
+    expect(rms <= CALIBRATION_MAX_RMS, msg.str());
+    expectCalibration(exampleDir, exampleDir, goldenDir, K, D);
+    return failures ? 1 : 0;
+}
+
+// Every stripe layout and execution mode of undistortFrame against the golden images.
+int testUndistort(const std::string& exampleDir, const std::string& goldenDir)
+{
+    cv::Matx33d K;
+    cv::Vec4d D;
+    if (!loadCalibration((fs::path(goldenDir) / "calibration.txt").string(), K, D))
+    {
+        return 1;
+    }
+    setThreadBudget(std::max(TEST_THREAD_BUDGET, cv::getNumberOfCPUs()));
+
+    for (const auto& p : listImages(exampleDir))
+    {
+        std::string name = p.filename().string();
+        cv::Mat distorted = cv::imread(p.string());
+        cv::Mat full = readGolden(goldenDir, p.stem().string() + ".png");
+        cv::Mat half = readGolden(goldenDir, p.stem().string() + "_half.png");
+        cv::Size size = distorted.size();
+        cv::Size halfSize(size.width / 2, size.height / 2);
+        cv::Mat out;
+
+        for (int stripes : { 1, 2, 3, 7, size.height })
+        {
+            undistortFrame(distorted, out, K, D, size, stripes);
+            expectImage(name + " with " + std::to_string(stripes) + " stripes", out, full, GOLDEN_MAX_LSB, GOLDEN_MIN_PSNR);
+        }
+
+        const std::map<std::string, ExecMode> modes = { {"auto", EXEC_AUTO}, {"tile", EXEC_TILE}, {"frame", EXEC_FRAME} };
+        for (const auto& mode : modes)
+        {
+            FrameSlot slot;
+            if (mode.second != EXEC_FRAME && size.height >= 2 * TILE_MIN_ROWS)
+            {
+                expect(resolveThreads(mode.second, 0, size) > 1, name + " is not tiled in " + mode.first + " mode");
+            }
+            undistortFrame(distorted, out, K, D, size, resolveThreads(mode.second, 0, size));
+            expectImage(name + " in " + mode.first + " mode", out, full, GOLDEN_MAX_LSB, GOLDEN_MIN_PSNR);
+
+            undistortFrame(distorted, out, K, D, halfSize, resolveThreads(mode.second, 0, halfSize));
+            expectImage(name + " at half size in " + mode.first + " mode", out, half, GOLDEN_MAX_LSB, GOLDEN_MIN_PSNR);
+        }
+    }
+    return failures ? 1 : 0;
+}
+
+// Checks what the CLI exported and saved against the golden outputs.
+int testCli(const std::string& outDir, const std::string& calibrationFile, const std::string& goldenDir)
+{
+    cv::Matx33d K;
+    cv::Vec4d D;
+    if (!loadCalibration(calibrationFile, K, D))
+    {
+        return 1;
+    }
+    // Export mode calibrates from the images next to the calibration file
+    expectCalibration(calibrationFile, fs::path(calibrationFile).parent_path().string(), goldenDir, K, D);
+
+    for (const auto& p : listImages(goldenDir))
+    {
+        std::string stem = p.stem().string();
+        if (stem.size() > 5 && stem.compare(stem.size() - 5, 5, "_half") == 0)
+        {
+            continue;
+        }
+        fs::path outPath = fs::path(outDir) / (stem + "_undistored.jpg");
+        cv::Mat out = cv::imread(outPath.string());
+        expect(!out.empty(), "missing CLI output " + outPath.string());
+        if (!out.empty())
+        {
+            expectImage(outPath.string(), out, cv::imread(p.string()), 255, LOSSY_MIN_PSNR);
+        }
+    }
+    return failures ? 1 : 0;
+}
+
+// Images per second of `run` over `frames` images, best of three rounds.
+double measure(int frames, const std::function<void()>& run)
+{
+    double best = 0;
+    for (int round = 0; round < 3; round++)
+    {
+        int count = 0;
+        auto start = std::chrono::steady_clock::now();
+        double elapsed = 0;
+        while (elapsed < THROUGHPUT_ROUND_SECONDS)
+        {
+            run();
+            count += frames;
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        best = std::max(best, count / elapsed);
+    }
+    return best;
+}
+
+// Compares each path with the baseline recorded on this machine, the first run records it.
+int testThroughput(const std::string& exampleDir, const std::string& goldenDir, const std::string& baselineFile, bool rerecord)
+{
+    cv::Matx33d K;
+    cv::Vec4d D;
+    if (!loadCalibration((fs::path(goldenDir) / "calibration.txt").string(), K, D))
+    {
+        return 1;
+    }
+    std::vector<cv::Mat> images;
+    for (const auto& p : listImages(exampleDir))
+    {
+        images.push_back(cv::imread(p.string()));
+    }
+    // Enough frames to keep every thread of the frame path busy
+    for (size_t i = 0; !images.empty() && images.size() < size_t(threadBudget().load()); i++)
+    {
+        images.push_back(images[i]);
+    }
+    int frames = int(images.size());
+
+    std::map<std::string, double> fps;
+    fps["reference"] = measure(frames, [&]() {
+        cv::Mat out;
+        for (const auto& img : images)
+        {
+            cv::fisheye::undistortImage(img, out, K, D, K, img.size());
+        }
+    });
+    fps["serial"] = measure(frames, [&]() {
+        cv::Mat out;
+        for (const auto& img : images)
+        {
+            undistortFrame(img, out, K, D, img.size(), 1);
+        }
+    });
+    fps["tile"] = measure(frames, [&]() {
+        cv::Mat out;
+        for (const auto& img : images)
+        {
+            undistortFrame(img, out, K, D, img.size(), threadBudget().load());
+        }
+    });
+    fps["frame"] = measure(frames, [&]() {
+        cv::parallel_for_(cv::Range(0, frames), [&](const cv::Range& range) {
+            cv::Mat out;
+            for (int i = range.start; i < range.end; i++)
+            {
+                undistortFrame(images[i], out, K, D, images[i].size(), 1);
+            }
+        });
+    });
+
+    std::map<std::string, double> baseline;
+    std::ifstream in(baselineFile);
+    std::string name;
+    double value;
+    while (in >> name >> value)
+    {
+        baseline[name] = value;
+    }
+
+    if (rerecord || baseline.empty())
+    {
+        std::ofstream out(baselineFile);
+        for (const auto& path : fps)
+        {
+            out << path.first << " " << path.second << std::endl;
+            std::cout << path.first << ": " << path.second << " images/s (recorded)" << std::endl;
+        }
+        return out ? 0 : 1;
+    }
+
+    for (const auto& path : fps)
+    {
+        std::cout << path.first << ": " << path.second << " images/s";
+        if (baseline.count(path.first))
+        {
+            double floor = baseline[path.first] * (1 - THROUGHPUT_TOLERANCE);
+            std::cout << ", baseline " << baseline[path.first];
+            std::ostringstream msg;
+            msg << path.first << " throughput " << path.second << " images/s is below " << floor;
+            expect(path.second >= floor, msg.str());
+        }
+        std::cout << std::endl;
+    }
+    return failures ? 1 : 0;
+}
+
+int usage()
+{
+    std::cout << "USAGE: ./fisheye_test record <example_dir> <golden_dir> [calibration_file]" << std::endl;
+    std::cout << "   Or: ./fisheye_test calibrate <example_dir> <golden_dir>" << std::endl;
+    std::cout << "   Or: ./fisheye_test undistort <example_dir> <golden_dir>" << std::endl;
+    std::cout << "   Or: ./fisheye_test cli <output_dir> <calibration_file> <golden_dir>" << std::endl;
+    std::cout << "   Or: ./fisheye_test throughput <example_dir> <golden_dir> <baseline_file> [--record]" << std::endl;
+    return 1;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 4)
+    {
+        return usage();
+    }
+    std::string command = argv[1];
+
+    if (command == "record")
+    {
+        return record(argv[2], argv[3], argc >= 5 ? argv[4] : "");
+    }
+    if (command == "calibrate")
+    {
+        return testCalibrate(argv[2], argv[3]);
+    }
+    if (command == "undistort")
+    {
+        return testUndistort(argv[2], argv[3]);
+    }
+    if (command == "cli" && argc >= 5)
+    {
+        return testCli(argv[2], argv[3], argv[4]);
+    }
+    if (command == "throughput" && argc >= 5)
+    {
+        bool rerecord = argc >= 6 && std::string(argv[5]) == "--record";
+        return testThroughput(argv[2], argv[3], argv[4], rerecord);
+    }
+    return usage();
+}
@@ -0,0 +1,331 @@
+const assert = require("assert");
+const fs = require("fs");
+const path = require("path");
+const zlib = require("zlib");
+const test = require("node:test");
+const fisheye = require("..");
+
+// Golden outputs are shared with the ctest target, see test/fisheye_test.cc.
+const GOLDEN_DIR = path.join(__dirname, "golden");
+const EXAMPLE_DIR = path.join(__dirname, "..", "example");
+const SETS = ["samples", "checkboard"];
+// Sample upscaled 8x, tall enough to be split into stripes, see test/fisheye_test.cc
+const LARGE_DIR = path.join(__dirname, "fixtures", "large");
+const CHECKBOARD_WIDTH = 9;
+const CHECKBOARD_HEIGHT = 6;
+
+// Same tolerances as test/fisheye_test.cc
+const GOLDEN_MAX_LSB = 1;
+const GOLDEN_MIN_PSNR = 50;
+const TEST_THREAD_BUDGET = 4;
+// K and D vary across OpenCV builds, a calibration is checked through its undistorted output
+const CALIBRATION_MIN_PSNR = 30;
+const THROUGHPUT_TOLERANCE = 0.3;
+const THROUGHPUT_ROUND_MS = 250;
+// Kept outside build/, which node-gyp rebuild wipes
+const BASELINE_FILE =
+  process.env.FISHEYE_THROUGHPUT_BASELINE || path.join(__dirname, ".throughput_baseline.json");
+
+function listImages(dir) {
+  return fs
+    .readdirSync(dir)
+    .filter(f => /\.(jpg|jpeg|png|bmp)$/i.test(f))
+    .sort()
+    .map(f => path.join(dir, f));
+}
+
+function loadCalibration(file) {
+  const v = fs.readFileSync(file, "utf8").trim().split(/\s+/).map(Number);
+  return {
+    K: [[v[0], 0, v[2]], [0, v[1], v[3]], [0, 0, 1]],
+    D: v.slice(4, 8)
+  };
+}
+
+// Decodes the 8-bit, non-interlaced PNGs written by cv::imencode.
+function decodePng(buf) {
+  let pos = 8;
+  let width, height, channels;
+  const idat = [];
+  while (pos < buf.length) {
+    const length = buf.readUInt32BE(pos);
+    const type = buf.toString("ascii", pos + 4, pos + 8);
+    const data = buf.subarray(pos + 8, pos + 8 + length);
+    if (type === "IHDR") {
+      width = data.readUInt32BE(0);
+      height = data.readUInt32BE(4);
+      assert.strictEqual(data[8], 8, "only 8-bit PNGs are supported");
+      channels = { 0: 1, 2: 3, 4: 2, 6: 4 }[data[9]];
+    } else if (type === "IDAT") {
+      idat.push(data);
+    }
+    pos += length + 12;
+  }
+
+  const raw = zlib.inflateSync(Buffer.concat(idat));
+  const stride = width * channels;
+  const pixels = Buffer.alloc(stride * height);
+  for (let y = 0; y < height; y++) {
+    const filter = raw[y * (stride + 1)];
+    const line = raw.subarray(y * (stride + 1) + 1, (y + 1) * (stride + 1));
+    for (let x = 0; x < stride; x++) {
+      const a = x >= channels ? pixels[y * stride + x - channels] : 0;
+      const b = y > 0 ? pixels[(y - 1) * stride + x] : 0;
+      const c = x >= channels && y > 0 ? pixels[(y - 1) * stride + x - channels] : 0;
+      let predictor;
+      switch (filter) {
+        case 0: predictor = 0; break;
+        case 1: predictor = a; break;
+        case 2: predictor = b; break;
+        case 3: predictor = (a + b) >> 1; break;
+        case 4: {
+          const p = a + b - c;
+          const pa = Math.abs(p - a), pb = Math.abs(p - b), pc = Math.abs(p - c);
+          predictor = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+          break;
+        }
+        default: throw new Error(`unknown PNG filter ${filter}`);
+      }
+      pixels[y * stride + x] = (line[x] + predictor) & 0xff;
+    }
+  }
+  return { width, height, channels, pixels };
+}
+
+function assertImage(what, out, golden, maxLsb = GOLDEN_MAX_LSB, minPsnr = GOLDEN_MIN_PSNR) {
+  assert.deepStrictEqual(
+    [out.width, out.height, out.channels],
+    [golden.width, golden.height, golden.channels],
+    `${what} size differs from golden`
+  );
+  let lsb = 0;
+  let squared = 0;
+  for (let i = 0; i < out.pixels.length; i++) {
+    const d = Math.abs(out.pixels[i] - golden.pixels[i]);
+    lsb = Math.max(lsb, d);
+    squared += d * d;
+  }
+  const mse = squared / out.pixels.length;
+  const psnr = mse === 0 ? Infinity : 10 * Math.log10((255 * 255) / mse);
+  assert.ok(lsb <= maxLsb && psnr >= minPsnr, `${what} max LSB ${lsb}, PSNR ${psnr}`);
+}
+
+// Undistorts the example images with K and D and compares them with the golden images.
+function assertCalibration(what, { K, D }, images, goldenDir) {
+  for (const file of images) {
+    const stem = path.basename(file, path.extname(file));
+    const out = fisheye.undistort(fs.readFileSync(file), K, D, { extname: ".png" });
+    const golden = decodePng(fs.readFileSync(path.join(goldenDir, `${stem}.png`)));
+    assertImage(`${what} on ${stem}`, decodePng(out), golden, 255, CALIBRATION_MIN_PSNR);
+  }
+}
+
+// Offsets of the JPEG markers in front of the entropy-coded data.
+function jpegMarkers(buf) {
+  const markers = {};
+  let pos = 2;
+  while (pos + 4 <= buf.length && buf[pos] === 0xff) {
+    const marker = buf[pos + 1];
+    markers[marker] = pos;
+    if (marker === 0xda) {
+      break;
+    }
+    pos += 2 + buf.readUInt16BE(pos + 2);
+  }
+  return markers;
+}
+
+// Every execution mode against the golden images, with a budget that allows tiling even on one core.
+function testUndistort(set, images, goldenDir, golden) {
+  for (const mode of ["auto", "tile", "frame"]) {
+    test(`undistort ${set} in ${mode} mode matches golden`, () => {
+      const budget = fisheye.setThreads();
+      fisheye.setThreads(Math.max(TEST_THREAD_BUDGET, budget));
+      try {
+        for (const file of images) {
+          const stem = path.basename(file, path.extname(file));
+          const img = fs.readFileSync(file);
+          const full = decodePng(fs.readFileSync(path.join(goldenDir, `${stem}.png`)));
+          const half = decodePng(fs.readFileSync(path.join(goldenDir, `${stem}_half.png`)));
+
+          const out = fisheye.undistort(img, golden.K, golden.D, { extname: ".png", mode });
+          assertImage(`${stem} in ${mode} mode`, decodePng(out), full);
+
+          const scaled = fisheye.undistort(img, golden.K, golden.D, { extname: ".png", mode, scale: 0.5 });
+          assertImage(`${stem} at scale 0.5 in ${mode} mode`, decodePng(scaled), half);
+
+          const capped = fisheye.undistort(img, golden.K, golden.D, { extname: ".png", mode, threads: 2 });
+          assertImage(`${stem} with 2 threads in ${mode} mode`, decodePng(capped), full);
+        }
+      } finally {
+        fisheye.setThreads(budget);
+      }
+    });
+  }
+}
+
+for (const set of SETS) {
+  const exampleDir = path.join(EXAMPLE_DIR, set);
+  const goldenDir = path.join(GOLDEN_DIR, set);
+  const golden = loadCalibration(path.join(goldenDir, "calibration.txt"));
+  const images = listImages(exampleDir);
+
+  test(`calibrate ${set} undistorts like the golden calibration`, () => {
+    const imgs = images.map(f => fs.readFileSync(f));
+    assertCalibration(set, fisheye.calibrate(imgs, CHECKBOARD_WIDTH, CHECKBOARD_HEIGHT), images, goldenDir);
+  });
+
+  testUndistort(set, images, goldenDir, golden);
+}
+
+testUndistort("large", listImages(LARGE_DIR), path.join(GOLDEN_DIR, "large"),
+  loadCalibration(path.join(GOLDEN_DIR, "large", "calibration.txt")));
+
+test("setThreads changes the budget", () => {
+  const budget = fisheye.setThreads();
+  assert.ok(budget >= 1);
+  assert.strictEqual(fisheye.setThreads(1), 1);
+  assert.throws(() => fisheye.setThreads("2"), TypeError);
+  assert.strictEqual(fisheye.setThreads(1), 1, "a rejected value must leave the budget alone");
+  assert.strictEqual(fisheye.setThreads(undefined), budget);
+  fisheye.setThreads(budget);
+});
+
+test("png encoder options keep the golden pixels", () => {
+  const golden = loadCalibration(path.join(GOLDEN_DIR, "samples", "calibration.txt"));
+  const img = fs.readFileSync(path.join(EXAMPLE_DIR, "samples", "IMG-0.jpg"));
+  const full = decodePng(fs.readFileSync(path.join(GOLDEN_DIR, "samples", "IMG-0.png")));
+  for (const pngStrategy of ["default", "filtered", "huffman", "rle", "fixed"]) {
+    const out = fisheye.undistort(img, golden.K, golden.D, { extname: ".png", pngStrategy, quantity: 1 });
+    assertImage(`pngStrategy ${pngStrategy}`, decodePng(out), full);
+  }
+});
+
+test("jpeg encoder options reach the encoder", (t) => {
+  const golden = loadCalibration(path.join(GOLDEN_DIR, "samples", "calibration.txt"));
+  const img = fs.readFileSync(path.join(EXAMPLE_DIR, "samples", "IMG-0.jpg"));
+  const undistort = extra => fisheye.undistort(img, golden.K, golden.D, { extname: ".jpg", ...extra });
+
+  // SOF0 marks a baseline JPEG, SOF2 a progressive one, DRI a restart interval
+  assert.ok(jpegMarkers(undistort({ jpegProgressive: false }))[0xc0] !== undefined);
+  assert.ok(jpegMarkers(undistort({ jpegProgressive: true }))[0xc2] !== undefined);
+  assert.ok(jpegMarkers(undistort({ jpegRestartInterval: 4 }))[0xdd] !== undefined);
+  assert.ok(undistort({ jpegOptimize: true }).length <= undistort({ jpegOptimize: false }).length);
+
+  let sampled;
+  try {
+    sampled = undistort({ jpegSampling: "4:4:4" });
+  } catch (err) {
+    t.skip(err.message);
+    return;
+  }
+  // The luma sampling factors follow the component id in the SOF0 segment
+  const sof = jpegMarkers(sampled)[0xc0];
+  assert.strictEqual(sampled[sof + 11], 0x11);
+  const subsampled = undistort({ jpegSampling: "4:2:0" });
+  assert.strictEqual(subsampled[jpegMarkers(subsampled)[0xc0] + 11], 0x22);
+});
+
+test("webp quantity reaches the encoder", (t) => {
+  const golden = loadCalibration(path.join(GOLDEN_DIR, "samples", "calibration.txt"));
+  const img = fs.readFileSync(path.join(EXAMPLE_DIR, "samples", "IMG-0.jpg"));
+  let low, high;
+  try {
+    low = fisheye.undistort(img, golden.K, golden.D, { extname: ".webp", quantity: 5 });
+    high = fisheye.undistort(img, golden.K, golden.D, { extname: ".webp", quantity: 95 });
+  } catch (err) {
+    t.skip(`OpenCV built without WebP: ${err.message}`);
+    return;
+  }
+  assert.ok(low.length < high.length, `quality 5 gave ${low.length} bytes, quality 95 gave ${high.length}`);
+});
+
+test("invalid options throw a TypeError", () => {
+  const golden = loadCalibration(path.join(GOLDEN_DIR, "samples", "calibration.txt"));
+  const img = fs.readFileSync(path.join(EXAMPLE_DIR, "samples", "IMG-0.jpg"));
+  const invalid = [
+    { mode: 1 },
+    { threads: "2" },
+    { mode: "bogus" },
+    { extname: 1 },
+    { quantity: "90" },
+    { extname: ".jpg", jpegSampling: 420 },
+    { extname: ".jpg", jpegRestartInterval: "4" },
+    { extname: ".png", pngStrategy: 2 },
+    { extname: ".png", pngStrategy: "bogus" }
+  ];
+  for (const extra of invalid) {
+    assert.throws(() => fisheye.undistort(img, golden.K, golden.D, extra), TypeError, JSON.stringify(extra));
+  }
+});
+
+test("an unknown extname throws a catchable Error", () => {
+  const golden = loadCalibration(path.join(GOLDEN_DIR, "samples", "calibration.txt"));
+  const img = fs.readFileSync(path.join(EXAMPLE_DIR, "samples", "IMG-0.jpg"));
+  assert.throws(() => fisheye.undistort(img, golden.K, golden.D, { extname: ".bogus" }), Error);
+  // The process and the encoder pool survive the failed call
+  const png = fisheye.undistort(img, golden.K, golden.D, { extname: ".png" });
+  assertImage("after .bogus", decodePng(png), decodePng(fs.readFileSync(path.join(GOLDEN_DIR, "samples", "IMG-0.png"))));
+});
+
+test("pooled output buffers are not reused while alive", () => {
+  const golden = loadCalibration(path.join(GOLDEN_DIR, "samples", "calibration.txt"));
+  const images = listImages(path.join(EXAMPLE_DIR, "samples")).map(f => fs.readFileSync(f));
+  const outputs = images.map(img => fisheye.undistort(img, golden.K, golden.D, { extname: ".png" }));
+  const copies = outputs.map(buf => Buffer.from(buf));
+  for (let i = 0; i < 32; i++) {
+    fisheye.undistort(images[i % images.length], golden.K, golden.D, { extname: ".png" });
+  }
+  outputs.forEach((buf, i) => assert.ok(buf.equals(copies[i]), `output ${i} changed after later calls`));
+});
+
+// Compares each path with the baseline recorded on this machine, the first run records it.
+test("throughput stays above the recorded baseline", () => {
+  const samples = {
+    golden: loadCalibration(path.join(GOLDEN_DIR, "samples", "calibration.txt")),
+    images: listImages(path.join(EXAMPLE_DIR, "samples")).map(f => fs.readFileSync(f))
+  };
+  // The sample frames are too short to tile, the modes are compared on the large fixture
+  const large = {
+    golden: loadCalibration(path.join(GOLDEN_DIR, "large", "calibration.txt")),
+    images: listImages(LARGE_DIR).map(f => fs.readFileSync(f))
+  };
+  const paths = {
+    "undistort:jpg": { ...samples, extra: { extname: ".jpg" } },
+    "undistort:png": { ...samples, extra: { extname: ".png" } },
+    "undistort:large:tile": { ...large, extra: { extname: ".jpg", mode: "tile" } },
+    "undistort:large:frame": { ...large, extra: { extname: ".jpg", mode: "frame" } }
+  };
+
+  const fps = {};
+  for (const [name, { golden, images, extra }] of Object.entries(paths)) {
+    let best = 0;
+    for (let round = 0; round < 3; round++) {
+      let count = 0;
+      const start = process.hrtime.bigint();
+      let elapsed = 0;
+      while (elapsed < THROUGHPUT_ROUND_MS) {
+        for (const img of images) {
+          fisheye.undistort(img, golden.K, golden.D, extra);
+        }
+        count += images.length;
+        elapsed = Number(process.hrtime.bigint() - start) / 1e6;
+      }
+      best = Math.max(best, (count * 1000) / elapsed);
+    }
+    fps[name] = best;
+  }
+
+  if (!fs.existsSync(BASELINE_FILE)) {
+    fs.mkdirSync(path.dirname(BASELINE_FILE), { recursive: true });
+    fs.writeFileSync(BASELINE_FILE, JSON.stringify(fps, null, 2));
+    return;
+  }
+  const baseline = JSON.parse(fs.readFileSync(BASELINE_FILE, "utf8"));
+  for (const [name, value] of Object.entries(fps)) {
+    if (baseline[name] !== undefined) {
+      const floor = baseline[name] * (1 - THROUGHPUT_TOLERANCE);
+      assert.ok(value >= floor, `${name} throughput ${value.toFixed(1)} images/s is below ${floor.toFixed(1)}`);
+    }
+  }
+});